@@ -1,8 +1,10 @@
 #include "Compressor.hpp"
 #define STB_IMAGE_IMPLEMENTATION
+#include <cmath>
 #include <iostream>
 #include <stb_image.h>
 #include <stdexcept>
+#include <thread>
 #include <vector>
 
 using namespace Example;
@@ -13,9 +15,19 @@ in vec2 v_texCoords;
 out vec4 fragmentColor;
 
 uniform sampler2D tex;
+uniform bool srgb;
+
+vec3 linearToSrgb(vec3 color) {
+    vec3 high = 1.055 * pow(color, vec3(1.0 / 2.4)) - 0.055;
+    return mix(color * 12.92, high, step(vec3(0.0031308), color));
+}
 
 void main() {
     fragmentColor = texture(tex, v_texCoords);
+    // The source was linearized by the preprocessor, store the mipmaps as sRGB again
+    if (srgb) {
+        fragmentColor.rgb = linearToSrgb(fragmentColor.rgb);
+    }
 }
 )";
 
@@ -33,6 +45,122 @@ void main() {
 
 static const float FULL_SCREEN_QUAD[] = {-1.0f, -1.0f, 1.0f, -1.0f, -1.0f, 1.0f, 1.0f, -1.0f, -1.0f, 1.0f, 1.0f, 1.0f};
 
+namespace {
+using ImagePtr = std::unique_ptr<stbi_uc, decltype(&stbi_image_free)>;
+
+struct Image {
+    // Set only if the decoded pixels can be uploaded as they are
+    ImagePtr decoded;
+    Preprocessor::Output output;
+
+    const void* data() const {
+        return decoded ? decoded.get() : output.pixels.data();
+    }
+};
+} // namespace
+
+static Image decode(const std::vector<std::string>& filenames, const Preprocessor::Options& options,
+                    const Preprocessor& preprocessor) {
+    std::vector<ImagePtr> images;
+    std::vector<Preprocessor::Source> sources;
+
+    for (const auto& filename : filenames) {
+        // Load the source image
+        int imgWidth, imgHeigth, imgChannels;
+        auto* image = stbi_load(filename.c_str(), &imgWidth, &imgHeigth, &imgChannels, STBI_rgb_alpha);
+
+        if (!image) {
+            throw std::runtime_error("Failed to open image file");
+        }
+
+        images.emplace_back(image, &stbi_image_free);
+
+        if (imgChannels != 3 && imgChannels != 4) {
+            throw std::runtime_error("Image must be RGB or RGBA");
+        }
+
+        // Always RGBA because we have asked for STBI_rgb_alpha
+        sources.push_back({imgWidth, imgHeigth, image});
+    }
+
+    // Nothing to do, skip the preprocessor and upload the decoded pixels directly
+    if (sources.size() == 1 && options.isIdentity()) {
+        Preprocessor::Output output{sources.front().width, sources.front().height, GL_RGBA8, GL_UNSIGNED_BYTE, {}};
+        return Image{std::move(images.front()), std::move(output)};
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    auto output = preprocessor.process(sources, options);
+    const auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    const auto pixels = static_cast<double>(output.width) * output.height;
+    std::cout << "Preprocess: " << output.width << "x" << output.height << " threads: " << preprocessor.getThreads()
+              << " time: " << elapsed * 1000.0 << " ms throughput: " << pixels / elapsed / 1000000.0 << " MPixels/s"
+              << std::endl;
+
+    return Image{{nullptr, &stbi_image_free}, std::move(output)};
+}
+
+static void checkArguments(const std::vector<GLuint>& targets, const GLsizei width) {
+    if (targets.empty()) {
+        throw std::runtime_error("At least one target format is required");
+    }
+
+    // Anything smaller would have no mipmap levels to render
+    if (width < 4 || (width & (width - 1)) != 0) {
+        throw std::runtime_error("Width must be a power of two and at least 4");
+    }
+}
+
+struct Compressor::Job {
+    enum class Stage { Upload, Render, Copy, Wait, Done };
+
+    Job(const std::vector<GLuint>& targets, const GLsizei width, const bool srgb)
+        : targets(targets), width(width), levels(static_cast<int>(std::log2(width)) - 1), srgb(srgb) {
+    }
+
+    ~Job() {
+        // Only non-zero if the job has not finished, for example due to an exception
+        if (!destinations.empty()) {
+            glDeleteTextures(static_cast<GLsizei>(destinations.size()), destinations.data());
+        }
+        if (source) {
+            glDeleteTextures(1, &source);
+        }
+        if (fboColor) {
+            glDeleteTextures(1, &fboColor);
+        }
+        if (fboDepth) {
+            glDeleteRenderbuffers(1, &fboDepth);
+        }
+        if (fbo) {
+            glDeleteFramebuffers(1, &fbo);
+        }
+        if (fence) {
+            glDeleteSync(fence);
+        }
+    }
+
+    std::vector<GLuint> targets;
+    GLsizei width;
+    int levels;
+    bool srgb;
+
+    Stage stage{Stage::Upload};
+    int level{0};
+    size_t target{0};
+
+    // Either decoded right away or by a worker thread
+    std::future<Image> pending;
+    std::vector<GLuint> destinations;
+    GLuint source{0};
+    GLuint fbo{0};
+    GLuint fboColor{0};
+    GLuint fboDepth{0};
+    GLsync fence{nullptr};
+    std::promise<std::vector<Result>> promise;
+};
+
 Compressor::Result::Result(const GLuint target, const GLuint ref) : target(target), ref(ref) {
 }
 
@@ -63,7 +191,8 @@ Compressor::Result& Compressor::Result::operator=(Result&& other) noexcept {
     return *this;
 }
 
-Compressor::Compressor() : shader(SHADER_VERT, SHADER_FRAG, std::nullopt) {
+Compressor::Compressor()
+    : shader(SHADER_VERT, SHADER_FRAG, std::nullopt), preprocessor(std::thread::hardware_concurrency()) {
     shader.setInt("tex", 0);
 
     vao.bind();
@@ -77,37 +206,176 @@ Compressor::Compressor() : shader(SHADER_VERT, SHADER_FRAG, std::nullopt) {
 Compressor::~Compressor() = default;
 
 Compressor::Result Compressor::compress(const std::string& filename, const GLuint target, const GLsizei width) {
-    auto levels = static_cast<int>(std::log2(width)) - 1;
+    auto results = compress(filename, std::vector<GLuint>{target}, width);
+    return std::move(results.front());
+}
 
-    // Load the source image
-    int imgWidth, imgHeigth, imgChannels;
-    auto* image = stbi_load(filename.c_str(), &imgWidth, &imgHeigth, &imgChannels, STBI_rgb_alpha);
+std::vector<Compressor::Result> Compressor::compress(const std::string& filename, const std::vector<GLuint>& targets,
+                                                     const GLsizei width) {
+    return compress(std::vector<std::string>{filename}, Preprocessor::Options{}, targets, width);
+}
 
-    if (!image) {
-        throw std::runtime_error("Failed to open image file");
+std::vector<Compressor::Result> Compressor::compress(const std::vector<std::string>& filenames,
+                                                     const Preprocessor::Options& options,
+                                                     const std::vector<GLuint>& targets, const GLsizei width) {
+    checkArguments(targets, width);
+
+    // Decoded on this thread when the job gets uploaded
+    Job job(targets, width, options.srgb);
+    job.pending = std::async(std::launch::deferred, decode, filenames, options, std::cref(preprocessor));
+
+    upload(job);
+
+    // Render the texture to the framebuffer, this will create mipmaps.
+    // This is done only once, no matter how many target formats are requested.
+    for (auto level = 0; level < job.levels; level++) {
+        renderLevel(job, level);
     }
 
-    if (imgChannels != 3 && imgChannels != 4) {
-        throw std::runtime_error("Image must be RGB or RGBA");
+    for (auto level = 0; level < job.levels; level++) {
+        for (size_t i = 0; i < job.targets.size(); i++) {
+            copyLevel(job, level, i);
+        }
     }
 
-    // Create the destination texture
-    GLuint destination;
-    glGenTextures(1, &destination);
-    glBindTexture(GL_TEXTURE_2D, destination);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levels - 1);
+    return finish(job);
+}
 
-    // Create texture from the source image
-    GLuint source;
-    glGenTextures(1, &source);
-    glBindTexture(GL_TEXTURE_2D, source);
-    if (imgChannels == 4) {
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, imgWidth, imgHeigth, 0, GL_RGBA, GL_UNSIGNED_BYTE, image);
-    } else {
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, imgWidth, imgHeigth, 0, GL_RGB, GL_UNSIGNED_BYTE, image);
+std::future<std::vector<Compressor::Result>>
+Compressor::compressAsync(const std::string& filename, const std::vector<GLuint>& targets, const GLsizei width) {
+    return compressAsync(std::vector<std::string>{filename}, Preprocessor::Options{}, targets, width);
+}
+
+std::future<std::vector<Compressor::Result>> Compressor::compressAsync(const std::vector<std::string>& filenames,
+                                                                       const Preprocessor::Options& options,
+                                                                       const std::vector<GLuint>& targets,
+                                                                       const GLsizei width) {
+    checkArguments(targets, width);
+
+    // The worker thread also runs the preprocessing, the job only keeps the upload ready pixels
+    auto job = std::make_unique<Job>(targets, width, options.srgb);
+    job->pending = std::async(std::launch::async, decode, filenames, options, std::cref(preprocessor));
+
+    auto future = job->promise.get_future();
+    jobs.push_back(std::move(job));
+    return future;
+}
+
+void Compressor::update(const std::chrono::microseconds budget) {
+    if (jobs.empty()) {
+        return;
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+
+    // The steps run in the middle of the caller's frame, keep its framebuffer and viewport
+    GLint framebuffer;
+    GLint viewport[4];
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &framebuffer);
+    glGetIntegerv(GL_VIEWPORT, viewport);
+
+    // Do at least one step per call, otherwise stop once the budget is used up or every job has to wait.
+    // Jobs that are waiting for the decoder or the GPU are skipped, older jobs still go first.
+    auto stepped = false;
+    do {
+        stepped = false;
+
+        for (auto it = jobs.begin(); it != jobs.end(); ++it) {
+            auto& job = **it;
+
+            try {
+                stepped = step(job);
+            } catch (...) {
+                job.promise.set_exception(std::current_exception());
+                job.stage = Job::Stage::Done;
+                stepped = true;
+            }
+
+            if (job.stage == Job::Stage::Done) {
+                jobs.erase(it);
+            }
+
+            if (stepped) {
+                break;
+            }
+        }
+    } while (stepped && std::chrono::steady_clock::now() - start < budget);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, static_cast<GLuint>(framebuffer));
+    glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+}
+
+bool Compressor::step(Job& job) {
+    switch (job.stage) {
+    case Job::Stage::Upload: {
+        // Wait for the worker thread to decode and preprocess the image
+        if (job.pending.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+            return false;
+        }
+        upload(job);
+        job.stage = Job::Stage::Render;
+        return true;
+    }
+    case Job::Stage::Render: {
+        renderLevel(job, job.level);
+        if (++job.level >= job.levels) {
+            job.level = 0;
+            job.stage = Job::Stage::Copy;
+        }
+        return true;
     }
-    stbi_image_free(image);
+    case Job::Stage::Copy: {
+        // One target per step, a single level 0 copy can already take a few milliseconds
+        copyLevel(job, job.level, job.target);
+        if (++job.target >= job.targets.size()) {
+            job.target = 0;
+            job.level++;
+        }
+        if (job.level >= job.levels) {
+            job.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+            glFlush();
+            job.stage = Job::Stage::Wait;
+        }
+        return true;
+    }
+    case Job::Stage::Wait: {
+        // Poll without blocking, the GPU may still be busy with the copies
+        const auto status = glClientWaitSync(job.fence, 0, 0);
+        if (status == GL_TIMEOUT_EXPIRED) {
+            return false;
+        }
+        if (status == GL_WAIT_FAILED) {
+            throw std::runtime_error("Failed to wait for the compression to finish");
+        }
+        glDeleteSync(job.fence);
+        job.fence = nullptr;
+        job.promise.set_value(finish(job));
+        job.stage = Job::Stage::Done;
+        return true;
+    }
+    default: {
+        return false;
+    }
+    }
+}
+
+void Compressor::upload(Job& job) {
+    const auto image = job.pending.get();
+
+    // Create the destination textures, one per target format
+    job.destinations.resize(job.targets.size());
+    glGenTextures(static_cast<GLsizei>(job.destinations.size()), job.destinations.data());
+    for (const auto destination : job.destinations) {
+        glBindTexture(GL_TEXTURE_2D, destination);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, job.levels - 1);
+    }
+
+    // Create texture from the preprocessed source image
+    glGenTextures(1, &job.source);
+    glBindTexture(GL_TEXTURE_2D, job.source);
+    glTexImage2D(GL_TEXTURE_2D, 0, image.output.internalFormat, image.output.width, image.output.height, 0, GL_RGBA,
+                 image.output.type, image.data());
 
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
@@ -115,74 +383,106 @@ Compressor::Result Compressor::compress(const std::string& filename, const GLuin
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
 
     // Create framebuffer with renderbuffer
-    GLuint fbo, fboColor, fboDepth;
+    glGenRenderbuffers(1, &job.fboDepth);
+    glBindRenderbuffer(GL_RENDERBUFFER, job.fboDepth);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, job.width, job.width);
 
-    glGenRenderbuffers(1, &fboDepth);
-    glBindRenderbuffer(GL_RENDERBUFFER, fboDepth);
-    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, width);
+    // Set the mipmap levels for the fbo color texture
+    glGenTextures(1, &job.fboColor);
+    glBindTexture(GL_TEXTURE_2D, job.fboColor);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, job.levels - 1);
 
-    glGenTextures(1, &fboColor);
-    glBindTexture(GL_TEXTURE_2D, fboColor);
+    glGenFramebuffers(1, &job.fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, job.fbo);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDER, job.fboDepth);
 
-    glGenFramebuffers(1, &fbo);
-    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
-    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDER, fboDepth);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
 
-    // Render the texture to the framebuffer, this will create mipmaps
-    for (auto level = 0; level < levels; level++) {
-        const auto w = width >> level;
-        glBindTexture(GL_TEXTURE_2D, fboColor);
-        glTexImage2D(GL_TEXTURE_2D, level, GL_RGBA8, w, w, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
-        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, fboColor, level);
+void Compressor::renderLevel(Job& job, const int level) {
+    // Render the texture to the framebuffer, this will create the mipmap level
+    const auto w = job.width >> level;
 
-        glViewport(0, 0, w, w);
+    glBindFramebuffer(GL_FRAMEBUFFER, job.fbo);
 
-        vao.bind();
-        glBindTexture(GL_TEXTURE_2D, source);
-        shader.use();
-        shader.drawArrays(GL_TRIANGLES, 2 * 3);
-    }
+    glBindTexture(GL_TEXTURE_2D, job.fboColor);
+    glTexImage2D(GL_TEXTURE_2D, level, GL_RGBA8, w, w, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, job.fboColor, level);
 
-    // Set the mipmap levels for the fbo color texture
-    glBindTexture(GL_TEXTURE_2D, fboColor);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levels - 1);
+    glViewport(0, 0, w, w);
+
+    // The level is freshly allocated and the pixels may be premultiplied, so write them as they are
+    const auto blend = glIsEnabled(GL_BLEND);
+    glDisable(GL_BLEND);
 
-    GLint totalBytes = 0;
+    vao.bind();
+    glBindTexture(GL_TEXTURE_2D, job.source);
+    shader.use();
+    shader.setInt("srgb", job.srgb ? 1 : 0);
+    shader.drawArrays(GL_TRIANGLES, 2 * 3);
+
+    if (blend) {
+        glEnable(GL_BLEND);
+    }
 
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+void Compressor::copyLevel(Job& job, const int level, const size_t index) {
     // Copy pixels as compressed texture
-    for (auto level = 0; level < levels; level++) {
-        const auto w = width >> level;
+    const auto w = job.width >> level;
 
-        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, fboColor, level);
+    glBindFramebuffer(GL_FRAMEBUFFER, job.fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, job.fboColor, level);
 
-        glBindTexture(GL_TEXTURE_2D, destination);
-        glCopyTexImage2D(GL_TEXTURE_2D, level, target, 0, 0, w, w, 0);
+    glBindTexture(GL_TEXTURE_2D, job.destinations[index]);
+    glCopyTexImage2D(GL_TEXTURE_2D, level, job.targets[index], 0, 0, w, w, 0);
 
-        // Optionally download the texture into a raw array.
-        // You can use this to save the generated texture into a file.
-        // This has to be done per mipmap level!
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
 
-        GLint compressedSize;
-        glGetTexLevelParameteriv(GL_TEXTURE_2D, level, GL_TEXTURE_COMPRESSED_IMAGE_SIZE, &compressedSize);
-        std::cout << "Mipmap: " << level << " size: " << w << "x" << w << " bytes: " << compressedSize << std::endl;
-        totalBytes += compressedSize;
+std::vector<Compressor::Result> Compressor::finish(Job& job) {
+    for (size_t i = 0; i < job.targets.size(); i++) {
+        GLint totalBytes = 0;
 
-        // std::vector<uint8_t> pixels;
-        // pixels.resize(compressedSize);
-        // glGetCompressedTexImage(GL_TEXTURE_2D, level, pixels.data());
-    }
+        glBindTexture(GL_TEXTURE_2D, job.destinations[i]);
 
-    std::cout << "Total bytes: " << totalBytes << std::endl;
+        for (auto level = 0; level < job.levels; level++) {
+            const auto w = job.width >> level;
 
-    // Cleanup
-    glDeleteTextures(1, &source);
-    glDeleteTextures(1, &fboColor);
-    glDeleteRenderbuffers(1, &fboDepth);
-    glDeleteFramebuffers(1, &fbo);
+            // Optionally download the texture into a raw array.
+            // You can use this to save the generated texture into a file.
+            // This has to be done per mipmap level!
 
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+            GLint compressedSize;
+            glGetTexLevelParameteriv(GL_TEXTURE_2D, level, GL_TEXTURE_COMPRESSED_IMAGE_SIZE, &compressedSize);
+            std::cout << "Target: " << job.targets[i] << " mipmap: " << level << " size: " << w << "x" << w
+                      << " bytes: " << compressedSize << std::endl;
+            totalBytes += compressedSize;
+
+            // std::vector<uint8_t> pixels;
+            // pixels.resize(compressedSize);
+            // glGetCompressedTexImage(GL_TEXTURE_2D, level, pixels.data());
+        }
+
+        std::cout << "Target: " << job.targets[i] << " total bytes: " << totalBytes << std::endl;
+    }
+
+    // Cleanup
+    glDeleteTextures(1, &job.source);
+    glDeleteTextures(1, &job.fboColor);
+    glDeleteRenderbuffers(1, &job.fboDepth);
+    glDeleteFramebuffers(1, &job.fbo);
+    job.source = job.fboColor = job.fboDepth = job.fbo = 0;
+
+    // The destination textures are now owned by the results
+    std::vector<Result> results;
+    results.reserve(job.targets.size());
+    for (const auto destination : job.destinations) {
+        results.emplace_back(GL_TEXTURE_2D, destination);
+    }
+    job.destinations.clear();
 
-    Result result(GL_TEXTURE_2D, destination);
-    return result;
+    return results;
 }
@@ -1,8 +1,15 @@
 #pragma once
 
+#include "Preprocessor.hpp"
 #include "Shader.hpp"
 #include "Vao.hpp"
 #include "Vbo.hpp"
+#include <chrono>
+#include <deque>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
 
 namespace Example {
 class Compressor {
@@ -37,10 +44,34 @@ public:
     ~Compressor();
 
     Result compress(const std::string& filename, GLuint target, GLsizei width);
+    std::vector<Result> compress(const std::string& filename, const std::vector<GLuint>& targets, GLsizei width);
+    std::vector<Result> compress(const std::vector<std::string>& filenames, const Preprocessor::Options& options,
+                                 const std::vector<GLuint>& targets, GLsizei width);
+
+    // Queues the compression and returns immediately. The image is decoded on a worker thread,
+    // the GPU work is done in small steps by update(), which must be called from the render thread.
+    // update() restores the framebuffer binding and the viewport. The caller has to bind its own
+    // program, VAO, GL_TEXTURE_2D texture and renderbuffer again after it.
+    std::future<std::vector<Result>> compressAsync(const std::string& filename, const std::vector<GLuint>& targets,
+                                                   GLsizei width);
+    std::future<std::vector<Result>> compressAsync(const std::vector<std::string>& filenames,
+                                                   const Preprocessor::Options& options,
+                                                   const std::vector<GLuint>& targets, GLsizei width);
+    void update(std::chrono::microseconds budget);
 
 private:
+    struct Job;
+
+    void upload(Job& job);
+    void renderLevel(Job& job, int level);
+    void copyLevel(Job& job, int level, size_t index);
+    bool step(Job& job);
+    std::vector<Result> finish(Job& job);
+
     Shader shader;
     Vao vao;
     Vbo vbo;
+    Preprocessor preprocessor;
+    std::deque<std::unique_ptr<Job>> jobs;
 };
 } // namespace Example
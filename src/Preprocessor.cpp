@@ -0,0 +1,183 @@
+#include "Preprocessor.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <exception>
+#include <stdexcept>
+#include <thread>
+
+using namespace Example;
+
+// Number of rows processed by a thread at once
+static const int BLOCK_ROWS = 32;
+
+static const std::array<uint16_t, 256> SRGB_TO_LINEAR = [] {
+    std::array<uint16_t, 256> table{};
+    for (size_t i = 0; i < table.size(); i++) {
+        const auto c = static_cast<double>(i) / 255.0;
+        const auto linear = c <= 0.04045 ? c / 12.92 : std::pow((c + 0.055) / 1.055, 2.4);
+        table[i] = static_cast<uint16_t>(std::lround(linear * 65535.0));
+    }
+    return table;
+}();
+
+bool Preprocessor::Options::isIdentity() const {
+    if (srgb || premultiply) {
+        return false;
+    }
+
+    for (size_t c = 0; c < swizzle.size(); c++) {
+        if (swizzle[c].source != 0 || swizzle[c].component != static_cast<int>(c)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+Preprocessor::Preprocessor(const unsigned int threads) : threads(std::max(threads, 1u)) {
+}
+
+Preprocessor::Output Preprocessor::process(const std::vector<Source>& sources, const Options& options) const {
+    if (sources.empty()) {
+        throw std::runtime_error("At least one source image is required");
+    }
+
+    for (const auto& source : sources) {
+        if (source.width != sources.front().width || source.height != sources.front().height) {
+            throw std::runtime_error("All source images must have the same size");
+        }
+    }
+
+    for (const auto& channel : options.swizzle) {
+        if (channel.component > 3 || (channel.component >= 0 && channel.source >= sources.size())) {
+            throw std::runtime_error("Invalid channel swizzle");
+        }
+    }
+
+    // Linear and premultiplied colors lose too much precision in 8 bits, upload them as 16 bits
+    const auto wide = options.srgb || options.premultiply;
+
+    Output output;
+    output.width = sources.front().width;
+    output.height = sources.front().height;
+    output.internalFormat = wide ? GL_RGBA16 : GL_RGBA8;
+    output.type = wide ? GL_UNSIGNED_SHORT : GL_UNSIGNED_BYTE;
+    output.pixels.resize(static_cast<size_t>(output.width) * output.height * 4 * (wide ? 2 : 1));
+
+    // Split the image into blocks of rows, each thread takes the next free block
+    const auto blocks = (output.height + BLOCK_ROWS - 1) / BLOCK_ROWS;
+    std::atomic<int> next{0};
+
+    const auto count = std::min(threads, static_cast<unsigned int>(std::max(blocks, 1)));
+    std::vector<std::exception_ptr> errors(count);
+
+    // Errors are collected per worker and rethrown by the calling thread
+    const auto work = [&](const unsigned int index) {
+        try {
+            std::vector<uint16_t> row(static_cast<size_t>(output.width) * 4);
+            for (auto block = next++; block < blocks; block = next++) {
+                const auto first = block * BLOCK_ROWS;
+                processRows(sources, options, output, row.data(), first, std::min(first + BLOCK_ROWS, output.height));
+            }
+        } catch (...) {
+            errors[index] = std::current_exception();
+            next = blocks;
+        }
+    };
+
+    std::vector<std::thread> workers;
+    workers.reserve(count);
+    for (auto i = 1u; i < count; i++) {
+        workers.emplace_back(work, i);
+    }
+    work(0);
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    for (const auto& error : errors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+    return output;
+}
+
+void Preprocessor::processRows(const std::vector<Source>& sources, const Options& options, Output& output,
+                               uint16_t* row, const int first, const int last) const {
+    // Each step below is a plain loop over a contiguous row, so that the compiler can vectorize it.
+    // Everything the loops read is kept in locals, the uint8_t stores could otherwise alias them.
+    const auto width = static_cast<size_t>(output.width);
+    const auto size = width * 4;
+    const auto wide = output.type == GL_UNSIGNED_SHORT;
+
+    // Constant channels are written as whole pixels, a strided store of a single channel does not vectorize
+    auto constants = false;
+    std::array<uint16_t, 4> pattern{};
+    for (size_t c = 0; c < 4; c++) {
+        if (options.swizzle[c].component < 0) {
+            pattern[c] = options.swizzle[c].constant;
+            constants = true;
+        }
+    }
+    const auto p0 = pattern[0], p1 = pattern[1], p2 = pattern[2], p3 = pattern[3];
+
+    for (auto y = first; y < last; y++) {
+        const auto offset = static_cast<size_t>(y) * width * 4;
+
+        if (constants) {
+            for (size_t x = 0; x < width; x++) {
+                row[x * 4 + 0] = p0;
+                row[x * 4 + 1] = p1;
+                row[x * 4 + 2] = p2;
+                row[x * 4 + 3] = p3;
+            }
+        }
+
+        // Swizzle, gather the other output channels from their source images
+        for (size_t c = 0; c < 4; c++) {
+            const auto& channel = options.swizzle[c];
+            if (channel.component >= 0) {
+                const auto* src = sources[channel.source].pixels + offset + channel.component;
+                for (size_t x = 0; x < width; x++) {
+                    row[x * 4 + c] = src[x * 4];
+                }
+            }
+        }
+
+        if (wide) {
+            // Widen to 16 bits, the color goes through the lookup table when converting from sRGB
+            if (options.srgb) {
+                for (size_t x = 0; x < width; x++) {
+                    row[x * 4 + 0] = SRGB_TO_LINEAR[row[x * 4 + 0]];
+                    row[x * 4 + 1] = SRGB_TO_LINEAR[row[x * 4 + 1]];
+                    row[x * 4 + 2] = SRGB_TO_LINEAR[row[x * 4 + 2]];
+                    row[x * 4 + 3] = static_cast<uint16_t>(row[x * 4 + 3] * 257);
+                }
+            } else {
+                for (size_t i = 0; i < size; i++) {
+                    row[i] = static_cast<uint16_t>(row[i] * 257);
+                }
+            }
+
+            if (options.premultiply) {
+                for (size_t x = 0; x < width; x++) {
+                    const uint32_t alpha = row[x * 4 + 3];
+                    row[x * 4 + 0] = static_cast<uint16_t>((row[x * 4 + 0] * alpha + 32767) / 65535);
+                    row[x * 4 + 1] = static_cast<uint16_t>((row[x * 4 + 1] * alpha + 32767) / 65535);
+                    row[x * 4 + 2] = static_cast<uint16_t>((row[x * 4 + 2] * alpha + 32767) / 65535);
+                }
+            }
+
+            auto* dst = reinterpret_cast<uint16_t*>(output.pixels.data()) + offset;
+            std::copy(row, row + size, dst);
+        } else {
+            auto* dst = output.pixels.data() + offset;
+            for (size_t i = 0; i < size; i++) {
+                dst[i] = static_cast<uint8_t>(row[i]);
+            }
+        }
+    }
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <glad/glad.h>
+#include <vector>
+
+namespace Example {
+class Preprocessor {
+public:
+    // Where an output channel is read from. A negative component writes the constant instead.
+    struct Channel {
+        size_t source;
+        int component;
+        uint8_t constant;
+    };
+
+    struct Options {
+        // Convert the color from sRGB to linear, the mipmaps are then filtered in linear space
+        bool srgb{false};
+        bool premultiply{false};
+        std::array<Channel, 4> swizzle{{{0, 0, 0}, {0, 1, 0}, {0, 2, 0}, {0, 3, 0}}};
+
+        // True if processing a single source would only copy its pixels
+        bool isIdentity() const;
+    };
+
+    // Decoded RGBA8 pixels
+    struct Source {
+        int width;
+        int height;
+        const uint8_t* pixels;
+    };
+
+    // Pixels in the layout expected by glTexImage2D, always GL_RGBA
+    struct Output {
+        int width;
+        int height;
+        GLenum internalFormat;
+        GLenum type;
+        std::vector<uint8_t> pixels;
+    };
+
+    explicit Preprocessor(unsigned int threads);
+
+    Output process(const std::vector<Source>& sources, const Options& options) const;
+
+    unsigned int getThreads() const {
+        return threads;
+    }
+
+private:
+    void processRows(const std::vector<Source>& sources, const Options& options, Output& output, uint16_t* row,
+                     int first, int last) const;
+
+    unsigned int threads;
+};
+} // namespace Example
@@ -123,30 +123,46 @@ void Window::run() {
 
     // The thing that will compress the texture
     Compressor compressor;
-    Compressor::Result result(0, 0);
+    std::vector<Compressor::Result> results;
+    std::future<std::vector<Compressor::Result>> pending;
 
     while (!glfwWindowShouldClose(window)) {
         int width, height;
         glfwGetFramebufferSize(window, &width, &height);
 
+        // Generate all formats at once, the source image is decoded and rendered into mipmaps only once
         if (shouldGenerate) {
-            const auto& tuple = tuples[tupleIndex];
-            const auto& name = std::get<0>(tuple);
-            const auto target = std::get<1>(tuple);
-            std::cout << "Generating as: " << name << "(" << target << ")" << std::endl;
-            result = compressor.compress("lena.png", target, 512);
+            std::vector<GLuint> targets;
+            for (const auto& tuple : tuples) {
+                const auto& name = std::get<0>(tuple);
+                const auto target = std::get<1>(tuple);
+                std::cout << "Generating as: " << name << "(" << target << ")" << std::endl;
+                targets.push_back(target);
+            }
+            // The sample image is sRGB, filter its mipmaps in linear space
+            Preprocessor::Options options;
+            options.srgb = true;
+            pending = compressor.compressAsync({"lena.png"}, options, targets, 512);
             shouldGenerate = false;
         }
 
+        // Spread the compression across frames, keep the results we have until the new ones are done
+        compressor.update(std::chrono::milliseconds(2));
+        if (pending.valid() && pending.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+            results = pending.get();
+        }
+
         glViewport(0, 0, width, height);
         glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
         glClear(GL_COLOR_BUFFER_BIT);
 
-        vao.bind();
-        result.bind();
-        shader.use();
-        shader.setInt("tex", 0);
-        shader.drawArrays(GL_TRIANGLES, 2 * 3);
+        if (!results.empty()) {
+            vao.bind();
+            results[tupleIndex].bind();
+            shader.use();
+            shader.setInt("tex", 0);
+            shader.drawArrays(GL_TRIANGLES, 2 * 3);
+        }
 
         glfwSwapBuffers(window);
         glfwPollEvents();
@@ -163,11 +179,11 @@ void Window::keyCallback(GLFWwindow* window, const int key, const int scancode,
 
     auto& self = *reinterpret_cast<Window*>(glfwGetWindowUserPointer(window));
     if (key == GLFW_KEY_SPACE && action == GLFW_PRESS) {
-        self.shouldGenerate = true;
         self.tupleIndex++;
         if (self.tupleIndex == tuples.size()) {
             self.tupleIndex = 0;
         }
+        std::cout << "Showing as: " << std::get<0>(tuples[self.tupleIndex]) << std::endl;
     }
 }
 